@@ -0,0 +1,53 @@
+#!/bin/sh
+# Render benchmark. Starts a private Xvfb sized for the given monitors and
+# runs xdmv for a fixed number of frames with every backend, printing one
+# line of per frame costs per backend.
+#
+#   WAV       16 bit wav file to feed in (required)
+#   OUTPUTS   monitor sizes, placed left to right
+#   FRAMES    frames per run
+#   BACKENDS  render backends to compare
+#   XDISPLAY  display number for Xvfb
+set -e
+
+WAV=${WAV:?set WAV to a 16 bit wav file}
+OUTPUTS=${OUTPUTS:-"3840x2160 3840x2160 3840x2160"}
+FRAMES=${FRAMES:-600}
+BACKENDS=${BACKENDS:-"core xrender"}
+XDISPLAY=${XDISPLAY:-:99}
+
+x=0
+h=0
+monitors=
+for o in $OUTPUTS; do
+    monitors="$monitors${monitors:+,}$o+$x+0"
+    x=$((x + ${o%x*}))
+    [ "${o#*x}" -gt "$h" ] && h=${o#*x}
+done
+
+socket="/tmp/.X11-unix/X${XDISPLAY#:}"
+if [ -e "$socket" ]; then
+    echo "display $XDISPLAY is already in use, set XDISPLAY" >&2
+    exit 1
+fi
+
+Xvfb "$XDISPLAY" -screen 0 "${x}x${h}x24" -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+trap 'kill $xvfb 2>/dev/null' EXIT INT TERM
+
+n=0
+until [ -S "$socket" ]; do
+    n=$((n + 1))
+    [ $n -gt 50 ] && { echo "Xvfb did not come up" >&2; exit 1; }
+    sleep 0.1
+done
+# the socket could belong to someone else if our server died on startup
+if ! kill -0 $xvfb 2>/dev/null; then
+    echo "Xvfb exited, is $XDISPLAY in use?" >&2
+    exit 1
+fi
+
+for b in $BACKENDS; do
+    ./xdmv -n "$FRAMES" -R "$b" -M "$monitors" -S "$xvfb" "$WAV" "$XDISPLAY" |
+        grep '^backend='
+done
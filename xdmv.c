@@ -4,12 +4,16 @@
 #include <unistd.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
@@ -17,6 +21,7 @@
 #include <X11/Xutil.h>
 #include <X11/extensions/Xdbe.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xrender.h>
 
 #include <fftw3.h>
 
@@ -26,6 +31,8 @@
 #include <pulse/error.h>
 #include <pulse/pulseaudio.h>
 
+#include "xdmv.h"
+
 /* Config */
 /* TODO replace these with functions that get these values dynamically/from
  * files */
@@ -40,6 +47,19 @@
 #define xdmv_box_size 7
 #define xdmv_box_margin 1
 #define xdmv_box_color 0x616568
+/* xrender backend: bar opacity at the base and at xdmv_height, in between
+ * it's a linear gradient */
+#define xdmv_bar_alpha_base 0xe0
+#define xdmv_bar_alpha_tip 0x40
+/* per spectrum, wider spectrums get wider spacing */
+#define xdmv_max_bars 512
+/* waterfall band, centered vertically, scrolls down by step rows a frame */
+#define xdmv_waterfall_height 200
+#define xdmv_waterfall_step 1
+
+/* channels asked for from pulse and jack, wav files bring their own */
+#define xdmv_capture_channels 2
+#define xdmv_max_channels 8
 
 #define xdmv_lowest_freq 20
 #define xdmv_highest_freq 20000
@@ -48,6 +68,38 @@
 /* must be odd number */
 #define xdmv_smooth_points 3
 
+/* quality governor */
+/* ms of work allowed per frame at xdmv_framerate, lower frame rates get a
+ * proportionally larger share */
+#define xdmv_frame_budget 8
+/* step down above this fraction of the budget, step up below the other one
+ * (measured against the budget of the level we would step up to) */
+#define xdmv_governor_down 0.9
+#define xdmv_governor_up 0.5
+/* frames a level is kept before the governor may change it again */
+#define xdmv_governor_hold 90
+/* number of fft sizes planned, each half the size of the previous one */
+#define xdmv_fft_levels 3
+
+/* capture recorder, written out by a separate thread so capture never waits
+ * on the disk. When all buffers are full new data is dropped. */
+#define xdmv_record_buffers 4
+#define xdmv_record_buffer_size (1 << 20)
+
+/* band features, published on the root window as _XDMV_FEATURES with -f */
+/* onset when the flux exceeds its running mean by this many deviations */
+#define xdmv_onset_threshold 2.0
+/* shortest time between onsets, ms */
+#define xdmv_onset_gap 100
+#define xdmv_tempo_min 60
+#define xdmv_tempo_max 200
+/* per frame decay of the onset autocorrelation */
+#define xdmv_tempo_decay 0.995
+/* momentary loudness window, ms */
+#define xdmv_loudness_window 400
+/* floor for the published loudness, LUFS */
+#define xdmv_loudness_floor -70
+
 /* filter settings */
 #define xdmv_integral 0.7
 #define xdmv_gravity 1.0
@@ -71,6 +123,11 @@ const float minMarginWeight = 0.6; // the minimum weight applied to bars in the
      __typeof__ (b) _b = (b); \
      _a > _b ? _a : _b; })
 
+#define min(a,b) \
+    ({ __typeof__ (a) _a = (a); \
+     __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
 #define eprintf(...) fprintf(stderr, __VA_ARGS__);
 
 #define dieifnull(p, reason) _dieifnull((p), (reason), __LINE__);
@@ -131,20 +188,16 @@ struct wav_header_chunk {
     uint32_t size;
 };
 
-struct sample {
-    int16_t l;
-    int16_t r;
-} *xdmv_wav_audio;
+/* interleaved frames of xdmv_analysis.channels samples */
+int16_t *xdmv_wav_audio;
 
 struct {
     jack_client_t *client;
     jack_status_t status;
-    jack_port_t *port_l;
-    jack_port_t *port_r;
+    jack_port_t *port[xdmv_max_channels];
     unsigned int pos;
 
-    float bufl[xdmv_sample_rate];
-    float bufr[xdmv_sample_rate];
+    float buf[xdmv_max_channels][xdmv_sample_rate];
 } xdmv_jack;
 
 struct {
@@ -152,24 +205,125 @@ struct {
     pthread_t thread;
     unsigned int pos;
     int status;
-    struct sample buf[xdmv_sample_rate + 256];
+    int16_t buf[(xdmv_sample_rate + 256) * xdmv_max_channels];
 
 } xdmv_pulse;
 
-typedef struct Spectrum {
-    float f[400];
-    int bars;
+/* Quality levels, best first. The governor walks down this list when frames
+ * run over budget: frame rate first, then fft size, smoothing and finally bar
+ * grouping. */
+struct quality {
+    int framerate;
+    int fft_shift;      /* fft size is xdmv_sample_rate >> fft_shift */
+    int smooth_passes;
+    int bar_group;      /* adjacent bars drawn as one */
+} xdmv_quality[] = {
+    { xdmv_framerate, 0, xdmv_smooth_passes, 1 },
+    { 45,             0, xdmv_smooth_passes, 1 },
+    { 30,             0, xdmv_smooth_passes, 1 },
+    { 30,             1, xdmv_smooth_passes, 1 },
+    { 30,             2, xdmv_smooth_passes, 1 },
+    { 30,             2, 1,                  1 },
+    { 30,             2, 0,                  1 },
+    { 30,             2, 0,                  2 },
+    { 30,             2, 0,                  4 },
+};
+#define xdmv_quality_levels (int)(sizeof(xdmv_quality) / sizeof(*xdmv_quality))
+
+enum stage {
+    stage_input = 0,
+    stage_fft,
+    stage_filter,
+    stage_render,
+    stage_swap,
+    stage_count,
+};
+
+struct {
+    int level;
+    int hold;
+    /* usec spent per stage in the current frame, and smoothed over frames */
+    unsigned long frame[stage_count];
+    double avg[stage_count];
+} xdmv_governor;
+
+/* Which channel each spectrum shows and which edge of the monitor it sits
+ * on. Spectrums sharing an edge split its width between them. output is the
+ * monitor index, or -1 for every monitor. edge_waterfall is a scrolling
+ * history band in the middle of the monitor rather than an edge. */
+enum edge {
+    edge_top = 0,
+    edge_bot,
+    edge_waterfall,
+    edge_count,
+};
+
+#define xdmv_channel_downmix (-1)
 
-    /* filter state */
-    int lcf[400], hcf[400];
-    float peak[401];
-    float fc[400], fre[400], weight[400], fmem[400], flast[400], fall[400],
-          fpeak[400];
+struct layout {
+    int output;
+    int channel;        /* or xdmv_channel_downmix for all channels averaged */
+    enum edge edge;
+} xdmv_layout[] = {
+    { -1, 0, edge_top },
+    { -1, 1, edge_bot },
+};
+#define xdmv_layout_count (int)(sizeof(xdmv_layout) / sizeof(*xdmv_layout))
+
+/* All channels go through a single batched fft. The input is channel-major
+ * with rows xdmv_sample_rate apart, the downmix (if any layout asks for it)
+ * is the row after the last channel. */
+#define xdmv_out_stride (xdmv_sample_rate / 2 + 1)
+
+struct {
+    int channels;
+    int rows;
+    int fft_size;
 
     double *in;
     fftw_complex *out;
     fftw_plan p;
-} Spectrum;
+    fftw_plan plans[xdmv_fft_levels];
+} xdmv_analysis;
+
+#define xdmv_tempo_lags (xdmv_framerate * 60 / xdmv_tempo_min + 1)
+#define xdmv_loudness_frames (xdmv_framerate * xdmv_loudness_window / 1000)
+
+struct Spectrum {
+    float f[xdmv_max_bars];
+    int bars, maxbars;
+    int box_width;
+    int fft_size;
+    int framerate;
+
+    /* placement, x and y are relative to the monitor */
+    enum edge edge;
+    int x, width;
+    int y, height;
+
+    /* edge_waterfall only: history kept on the server and its newest rows */
+    Pixmap history;
+    XImage *row;
+
+    /* filter state */
+    int lcf[xdmv_max_bars + 1], hcf[xdmv_max_bars];
+    float peak[xdmv_max_bars + 1];
+    float fc[xdmv_max_bars + 1], fre[xdmv_max_bars + 1], weight[xdmv_max_bars],
+          fmem[xdmv_max_bars], flast[xdmv_max_bars], fall[xdmv_max_bars],
+          fpeak[xdmv_max_bars];
+
+    /* feature state, band energy is the sum of |X|^2 over the band */
+    struct features features;
+    double energy[xdmv_max_bars];
+    float kweight[xdmv_max_bars], flast_log[xdmv_max_bars], flux[xdmv_max_bars];
+    float flux_mean, flux_dev, flux_prev;
+    int frames, since_onset;
+    float onsets[xdmv_tempo_lags], autocorr[xdmv_tempo_lags];
+    double power[xdmv_loudness_frames], power_sum;
+
+    /* row of xdmv_analysis.out */
+    fftw_complex *out;
+};
 
 struct xdmv {
     Display *display;
@@ -181,7 +335,8 @@ struct xdmv {
         XRROutputInfo *info;
         XRRCrtcInfo *crtc;
 
-        Spectrum spectruml, spectrumr;
+        Spectrum *spectrums;
+        int nspectrums;
 
         struct output_list *next;
     } *output_list;
@@ -195,12 +350,129 @@ struct xdmv {
     uint32_t sample_rate;
 } xdmv;
 
+/* set by the signal handler, acted on by the render loop */
+volatile sig_atomic_t xdmv_running, xdmv_quit;
+
 enum {
     source_file_wav = 0,
     source_jack,
     source_pulse,
 } xdmv_source;
 
+/* Recording format: a header followed by blocks. Audio blocks hold what the
+ * capture thread put in its ring buffer starting at ring position pos, frame
+ * blocks what the render loop saw. */
+struct record_header {
+    char magic[8];
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t source;
+};
+
+struct record_block {
+    uint32_t type;
+    uint32_t size;
+};
+
+enum {
+    record_audio = 1,
+    record_frame,
+};
+
+struct record_frame {
+    uint64_t t;
+    uint32_t pos;
+    uint32_t level;
+};
+
+#define xdmv_record_magic "XDMVREC1"
+
+struct {
+    int fd;
+    int active;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* buffers tail .. tail + full - 1 wait for the writer, head is filling */
+    char *buf[xdmv_record_buffers];
+    size_t used[xdmv_record_buffers];
+    int head, tail, full;
+    int stop;
+    unsigned long dropped;
+} xdmv_record = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* render backends, picked with -R */
+enum {
+    backend_core = 0,
+    backend_xrender,
+    backend_count,
+} xdmv_backend;
+
+const char *xdmv_backend_names[backend_count] = {
+    "core",
+    "xrender",
+};
+
+/* Bar tiles for the xrender backend. A tile is one bar spacing wide and
+ * xdmv_height tall, holds the gradient in its first width columns and is
+ * repeated horizontally, so a whole spectrum is one composite. */
+#define xdmv_max_tiles 32
+
+struct {
+    Picture dst;
+    XRenderPictFormat *mask;
+
+    struct tile {
+        int spacing, width, height;
+        enum edge edge;
+        Picture picture;
+    } tiles[xdmv_max_tiles];
+    int ntiles, evict;
+
+    XTrapezoid traps[xdmv_max_bars];
+} xdmv_xrender;
+
+/* Benchmark mode (-n): a fixed number of frames on a simulated clock, no
+ * governor and no sleeping, then per frame costs are printed. Monitors can be
+ * faked with -M since Xvfb only has the one output. */
+#define xdmv_bench_max_outputs 16
+
+struct {
+    unsigned long frames;
+    pid_t server;
+
+    XRRCrtcInfo outputs[xdmv_bench_max_outputs];
+    int noutputs;
+
+    /* counters at the start of the run */
+    struct rusage usage;
+    unsigned long server_ticks;
+    int server_ok;
+    unsigned long request;
+    unsigned long long wchar, rchar, syscr;
+} xdmv_bench;
+
+struct {
+    char *data;
+    size_t size;
+    size_t frame, audio;    /* offsets of the next frame and audio block */
+    int fast;
+    FILE *bars;             /* bar heights of every frame, for comparing runs */
+} xdmv_replay;
+
+/* Features of the first monitor on the root window (-f). Off by default since
+ * every client watching the root window wakes up on each change. */
+struct {
+    int enabled;
+    long last[xdmv_layout_count * 5];
+    int n;
+} xdmv_feature_export;
+
 /* Program */
 
 unsigned long
@@ -212,6 +484,15 @@ gettime()
     return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+unsigned long
+gettime_us()
+{
+    /* Time in microseconds, only used for measuring frame stages */
+    static struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 int
 xdmv_sleep(unsigned long ms)
 {
@@ -219,7 +500,9 @@ xdmv_sleep(unsigned long ms)
     rts.tv_sec = ms / 1000;
     rts.tv_nsec = ms % 1000 * 1000 * 1000;
 
-    if (clock_nanosleep(CLOCK_MONOTONIC, 0, &rts, 0)) {
+    /* a signal cuts the sleep short, the main loop looks at xdmv_quit */
+    int err = clock_nanosleep(CLOCK_MONOTONIC, 0, &rts, 0);
+    if (err && err != EINTR) {
         perror("clock_nanosleep");
         die("I'm a terrible person -- clock");
     }
@@ -227,6 +510,26 @@ xdmv_sleep(unsigned long ms)
     return 0;
 }
 
+void
+xdmv_thread_create(pthread_t *thread, void *(*fn)(void *), const char *what)
+{
+    /* Helper threads never see SIGINT/SIGTERM, the main thread handles them
+     * so that cleanup only ever runs there */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    int n = pthread_create(thread, NULL, fn, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (n) {
+        errno = n;
+        perror("pthread");
+        die(what);
+    }
+}
+
 int
 xdmv_set_prop(Display *d, Window w, const char *prop, const char *atom)
 {
@@ -258,9 +561,12 @@ filter_savitskysmooth(Spectrum *s)
     /* Savitsky-Golay smoothing algorithm */
     /* from vis.js */
     int bars = s->bars;
-    static float newArr[500];
+    int passes = xdmv_quality[xdmv_governor.level].smooth_passes;
+    static float newArr[xdmv_max_bars];
     float *lastArray = s->f;
-    for (int pass = 0; pass < xdmv_smooth_passes; pass++) {
+    if (!passes)
+        return;
+    for (int pass = 0; pass < passes; pass++) {
         // our window is centered so this is both nL and nR
         double sidePoints = floor(xdmv_smooth_points / 2);
         double cn = 1 / (2 * sidePoints + 1);
@@ -326,7 +632,7 @@ filter_gravity(Spectrum *s)
     float *f = s->f, *fall = s->fall, *fpeak = s->fpeak, *flast = s->flast;
     int bars = s->bars;
     /* float g = xdmv_gravity * xdmv_height / 270 * pow(60.0 / xdmv_framerate, 2.5); */
-    float g = xdmv_gravity * pow(120.0 / xdmv_framerate, 2.5);
+    float g = xdmv_gravity * pow(120.0 / xdmv_quality[xdmv_governor.level].framerate, 2.5);
     float temp;
 
     for (int o = 0; o < bars; o++) {
@@ -356,14 +662,18 @@ separate_freq_bands(Spectrum *s)
     int bars = s->bars;
     int o,i;
     float *f = s->f, *peak = s->peak;
+    double *energy = s->energy;
 
     // process: separate frequency bands
     for (o = 0; o < bars; o++) {
         peak[o] = 0;
+        energy[o] = 0;
 
-        /* get peaks */
+        /* get peaks, keep the energy around for the features */
         for (i = lcf[o]; i <= hcf[o]; i++) {
-            peak[o] += pow(pow(out[i][0], 2) + pow(out[i][1], 2), 0.5);
+            double p = out[i][0] * out[i][0] + out[i][1] * out[i][1];
+            energy[o] += p;
+            peak[o] += sqrt(p);
         }
 
         /* getting average */
@@ -381,7 +691,7 @@ xdmv_spectrum_calculate(Spectrum *s)
     int lowcf = xdmv_lowest_freq,
         highcf = xdmv_highest_freq,
         rate = xdmv.sample_rate / 2,
-        M = xdmv_sample_rate - 2;
+        M = s->fft_size - 2;
 
     int bars = s->bars;
     float *fc = s->fc, *fre = s->fre, *weight = s->weight;
@@ -403,17 +713,186 @@ xdmv_spectrum_calculate(Spectrum *s)
         }
     }
 
+    /* A small fft has fewer bins than a wide monitor has bars. The plan
+     * only writes bins up to fft_size / 2, so the top bars share the last
+     * one rather than reading stale output. */
+    int last = s->fft_size / 2;
+    for (int n = 0; n < bars; n++) {
+        lcf[n] = min(lcf[n], last);
+        hcf[n] = max(min(hcf[n], last), lcf[n]);
+    }
+
     for (int n = 0; n < bars; n++) {
         /* weight[n] = pow(fc[n], 0.75) / xdmv_sample_rate / 2000 * xdmv_height; */
-        weight[n] = (double)1 / xdmv_sample_rate * log10(fc[n]) * ((double)n / bars + 1) / 20 * xdmv_height;
+        weight[n] = (double)1 / s->fft_size * log10(fc[n]) * ((double)n / bars + 1) / 20 * xdmv_height;
 
         /* int offset = sizeof(xdmv_weight) / sizeof(*xdmv_weight) * n / bars; */
-        if (n != 0)
-            printf("%d: %f -> %f (%d -> %d) [%fx]\n", n, fc[n - 1], fc[n], lcf[n - 1], hcf[n - 1], weight[n - 1]);
-
         /* weight[n] *= xdmv_weight[offset]; */
     }
 
+    /* K-weighting at the band centers: roughly the BS.1770 high shelf
+     * (+4dB above ~1.5kHz) and the high pass at 38Hz, as power gains */
+    for (int n = 0; n < bars; n++) {
+        double f = sqrt(fc[n] * fc[n + 1]);
+        double shelf = 4.0 * f * f / (f * f + 1500.0 * 1500.0);
+        double hp = pow(f, 4) / (pow(f, 4) + pow(38.0, 4));
+        s->kweight[n] = pow(10, shelf / 10) * hp;
+    }
+
+}
+
+void
+xdmv_spectrum_print(Spectrum *s)
+{
+    for (int n = 1; n < s->bars; n++)
+        printf("%d: %f -> %f (%d -> %d) [%fx]\n", n, s->fc[n - 1], s->fc[n],
+                s->lcf[n - 1], s->hcf[n - 1], s->weight[n - 1]);
+}
+
+void
+xdmv_features_reset(Spectrum *s)
+{
+    /* history is in frames, so it has to go when the frame rate or the
+     * bands change */
+    memset(&s->features, 0, sizeof s->features);
+    memset(s->flast_log, 0, sizeof s->flast_log);
+    memset(s->flux, 0, sizeof s->flux);
+    memset(s->onsets, 0, sizeof s->onsets);
+    memset(s->autocorr, 0, sizeof s->autocorr);
+    memset(s->power, 0, sizeof s->power);
+    s->flux_mean = s->flux_dev = s->flux_prev = 0;
+    s->power_sum = 0;
+    s->frames = s->since_onset = 0;
+}
+
+void
+features_update(Spectrum *s)
+{
+    /* Everything here is O(bars) or O(lags) per frame, working off what
+     * separate_freq_bands already computed */
+    struct features *ft = &s->features;
+    int bars = s->bars;
+    int fps = xdmv_quality[xdmv_governor.level].framerate;
+    int frame = s->frames++;
+
+    /* spectral flux and band energy */
+    double total = 0, power = 0;
+    for (int o = 0; o < bars; o++) {
+        float l = log1pf(s->peak[o]);
+        float d = l - s->flast_log[o];
+        s->flux[o] = d > 0 ? d : 0;
+        s->flast_log[o] = l;
+        total += s->flux[o];
+        power += s->kweight[o] * s->energy[o];
+    }
+    /* the first frame has nothing to compare with */
+    float flux = frame && bars ? total / bars : 0;
+
+    /* onsets against a running mean and deviation of the flux */
+    float threshold = s->flux_mean + xdmv_onset_threshold * s->flux_dev;
+    s->since_onset++;
+    ft->onset = 0;
+    ft->onset_strength = 0;
+    if (frame > fps / 2 && flux > threshold && flux >= s->flux_prev &&
+            s->since_onset * 1000 >= xdmv_onset_gap * fps) {
+        ft->onset = 1;
+        ft->onset_strength = flux - threshold;
+        s->since_onset = 0;
+    }
+    s->flux_dev += (fabsf(flux - s->flux_mean) - s->flux_dev) * 0.05f;
+    s->flux_mean += (flux - s->flux_mean) * 0.05f;
+    s->flux_prev = flux;
+
+    /* tempo from a decaying autocorrelation of the onset envelope */
+    int lags = fps * 60 / xdmv_tempo_min + 1;
+    int lo = fps * 60 / xdmv_tempo_max, hi = lags - 1;
+    float env = max(0.0f, flux - s->flux_mean);
+    int pos = frame % lags;
+    int best = 0;
+    for (int lag = lo; lag <= hi; lag++) {
+        s->autocorr[lag] = s->autocorr[lag] * xdmv_tempo_decay +
+            env * s->onsets[(pos - lag + lags) % lags];
+        if (!best || s->autocorr[lag] > s->autocorr[best])
+            best = lag;
+    }
+    s->onsets[pos] = env;
+    ft->tempo = frame >= lags && best && s->autocorr[best] > 0 ?
+        60.0f * fps / best : 0;
+
+    /* mean square relative to full scale, one sided spectrum, averaged over
+     * the loudness window */
+    double n = s->fft_size;
+    power *= 2 / (n * n) / (32768.0 * 32768.0);
+    int window = max(1, fps * xdmv_loudness_window / 1000);
+    int slot = frame % window;
+    s->power_sum += power - s->power[slot];
+    s->power[slot] = power;
+    double ms = s->power_sum / min(frame + 1, window);
+    ft->loudness = ms > 0 ? -0.691 + 10 * log10(ms) : -INFINITY;
+
+    ft->bars = bars;
+    ft->flux = s->flux;
+    ft->flux_total = flux;
+}
+
+const struct features *
+xdmv_spectrum_features(const Spectrum *s)
+{
+    return &s->features;
+}
+
+void
+xdmv_features_publish(Display *d, Window w, struct output_list *ol)
+{
+    /* Five integers per spectrum of the first output in layout order:
+     * onset, onset strength * 1000, bpm * 100, LUFS * 100 and flux * 1000.
+     * Only written when one of them changed. */
+    long v[xdmv_layout_count * 5];
+    int n = 0;
+    for (int i = 0; i < ol->nspectrums; i++) {
+        const struct features *ft = xdmv_spectrum_features(&ol->spectrums[i]);
+        float lufs = ft->loudness > xdmv_loudness_floor ?
+            ft->loudness : xdmv_loudness_floor;
+        v[n++] = ft->onset;
+        v[n++] = lrintf(ft->onset_strength * 1000);
+        v[n++] = lrintf(ft->tempo * 100);
+        v[n++] = lrintf(lufs * 100);
+        v[n++] = lrintf(ft->flux_total * 1000);
+    }
+    if (n == xdmv_feature_export.n &&
+            !memcmp(v, xdmv_feature_export.last, sizeof *v * n))
+        return;
+    memcpy(xdmv_feature_export.last, v, sizeof *v * n);
+    xdmv_feature_export.n = n;
+
+    Atom xa = XInternAtom(d, "_XDMV_FEATURES", False);
+    XChangeProperty(d, w, xa, XA_INTEGER, 32, PropModeReplace,
+            (unsigned char *) v, n);
+}
+
+void
+xdmv_spectrum_configure(Spectrum *s, const struct quality *q)
+{
+    /* Apply a quality level. Filter state is dropped since the bars it
+     * belongs to may not exist anymore, feature history only when the frame
+     * rate or the bands it was measured with change. */
+    int bars = s->maxbars / q->bar_group;
+    int fft_size = xdmv_sample_rate >> q->fft_shift;
+    if (bars != s->bars || fft_size != s->fft_size ||
+            q->framerate != s->framerate)
+        xdmv_features_reset(s);
+
+    s->bars = bars;
+    s->box_width = xdmv_box_size + (q->bar_group - 1) * (xdmv_box_size + xdmv_box_margin);
+    s->fft_size = fft_size;
+    s->framerate = q->framerate;
+
+    memset(s->fmem, 0, sizeof s->fmem);
+    memset(s->flast, 0, sizeof s->flast);
+    memset(s->fall, 0, sizeof s->fall);
+    memset(s->fpeak, 0, sizeof s->fpeak);
+
+    xdmv_spectrum_calculate(s);
 }
 
 void
@@ -421,6 +900,7 @@ xdmv_spectrum_create(Display *d, int s, Window w, Pixmap bg, unsigned int t,
         Spectrum *sp)
 {
     separate_freq_bands(sp);
+    features_update(sp);
     filter_savitskysmooth(sp);
     /* filter_marginsmooth(sp); */
     filter_integral(sp);
@@ -428,11 +908,341 @@ xdmv_spectrum_create(Display *d, int s, Window w, Pixmap bg, unsigned int t,
     filter_freqweight(sp);
 }
 
+/* Deinterleaving kernels. Common channel counts get their own copy so the
+ * compiler sees a constant stride and can vectorize the loads. Rows start
+ * from fftw_malloc and are xdmv_sample_rate apart, so they stay aligned. */
+#define deinterleave_kernel(ch) \
+void \
+xdmv_deinterleave_##ch(double *restrict dst, size_t at, \
+        const int16_t *restrict src, size_t n) \
+{ \
+    for (int c = 0; c < ch; c++) { \
+        double *restrict row = \
+            __builtin_assume_aligned(dst + c * xdmv_sample_rate, 16); \
+        for (size_t i = 0; i < n; i++) \
+            row[at + i] = src[i * ch + c]; \
+    } \
+}
+
+deinterleave_kernel(1)
+deinterleave_kernel(2)
+deinterleave_kernel(6)
+deinterleave_kernel(8)
+
+void
+xdmv_deinterleave(double *dst, size_t at, const int16_t *src, size_t n,
+        int channels)
+{
+    switch (channels) {
+        case 1: xdmv_deinterleave_1(dst, at, src, n); break;
+        case 2: xdmv_deinterleave_2(dst, at, src, n); break;
+        case 6: xdmv_deinterleave_6(dst, at, src, n); break;
+        case 8: xdmv_deinterleave_8(dst, at, src, n); break;
+        default:
+            for (int c = 0; c < channels; c++) {
+                double *row = dst + c * xdmv_sample_rate;
+                for (size_t i = 0; i < n; i++)
+                    row[at + i] = src[i * channels + c];
+            }
+    }
+}
+
+void
+xdmv_analysis_downmix(size_t n)
+{
+    int channels = xdmv_analysis.channels;
+    double *restrict mix = __builtin_assume_aligned(
+            xdmv_analysis.in + channels * xdmv_sample_rate, 16);
+    double k = 1.0 / channels;
+
+    memcpy(mix, xdmv_analysis.in, n * sizeof *mix);
+    for (int c = 1; c < channels; c++) {
+        const double *restrict row = __builtin_assume_aligned(
+                xdmv_analysis.in + c * xdmv_sample_rate, 16);
+        for (size_t i = 0; i < n; i++)
+            mix[i] += row[i];
+    }
+    for (size_t i = 0; i < n; i++)
+        mix[i] *= k;
+}
+
+void
+xdmv_analysis_load(unsigned long t)
+{
+    /* Fill the input block with fft_size frames of every channel */
+    size_t n = xdmv_analysis.fft_size, offset, head;
+    int channels = xdmv_analysis.channels;
+    double *in = xdmv_analysis.in;
+
+    switch (xdmv_source) {
+        case source_file_wav:
+            offset = xdmv.sample_rate * t / 1000;
+            xdmv_deinterleave(in, 0, xdmv_wav_audio + offset * channels, n,
+                    channels);
+            break;
+        case source_jack:
+            offset = xdmv.sample_rate * t / 4000 % xdmv_sample_rate;
+            head = min(n, xdmv_sample_rate - offset);
+            for (int c = 0; c < channels; c++) {
+                double *row = in + c * xdmv_sample_rate;
+                const float *buf = xdmv_jack.buf[c];
+                for (size_t i = 0; i < head; i++)
+                    row[i] = buf[offset + i] * 65536;
+                for (size_t i = head; i < n; i++)
+                    row[i] = buf[i - head] * 65536;
+            }
+            break;
+        case source_pulse:
+            offset = xdmv.sample_rate * t / 1000 % xdmv_sample_rate;
+            head = min(n, xdmv_sample_rate - offset);
+            xdmv_deinterleave(in, 0, xdmv_pulse.buf + offset * channels, head,
+                    channels);
+            xdmv_deinterleave(in, head, xdmv_pulse.buf, n - head, channels);
+            break;
+        default:
+            die("wtf?");
+    }
+
+    if (xdmv_analysis.rows > channels)
+        xdmv_analysis_downmix(n);
+}
+
+void
+xdmv_analysis_configure(const struct quality *q)
+{
+    xdmv_analysis.fft_size = xdmv_sample_rate >> q->fft_shift;
+    xdmv_analysis.p = xdmv_analysis.plans[q->fft_shift];
+}
+
+void
+xdmv_analysis_init(void)
+{
+    int channels = xdmv_analysis.channels;
+    xdmv_analysis.rows = channels;
+    for (int i = 0; i < xdmv_layout_count; i++)
+        if (xdmv_layout[i].channel == xdmv_channel_downmix)
+            xdmv_analysis.rows = channels + 1;
+
+    int rows = xdmv_analysis.rows;
+    xdmv_analysis.in = fftw_malloc(sizeof(*xdmv_analysis.in) * xdmv_sample_rate * rows);
+    xdmv_analysis.out = fftw_malloc(sizeof(*xdmv_analysis.out) * xdmv_out_stride * rows);
+    dieif(!xdmv_analysis.in || !xdmv_analysis.out, "Could not allocate fft buffers");
+
+    /* FFTW_MEASURE picks plans by timing them, so two runs can round
+     * differently. Recordings, replays and bar dumps need the same plan
+     * every time. */
+    unsigned int flags = FFTW_MEASURE;
+    if (xdmv_replay.data || xdmv_replay.bars || xdmv_record.fd >= 0)
+        flags = FFTW_ESTIMATE;
+
+    /* plan every size the governor may pick, planning later would stall */
+    for (int i = 0; i < xdmv_fft_levels; i++) {
+        int n = xdmv_sample_rate >> i;
+        xdmv_analysis.plans[i] = fftw_plan_many_dft_r2c(1, &n, rows,
+                xdmv_analysis.in, NULL, 1, xdmv_sample_rate,
+                xdmv_analysis.out, NULL, 1, xdmv_out_stride, flags);
+        dieifnull(xdmv_analysis.plans[i], "Could not plan fft");
+    }
+    /* planning with FFTW_MEASURE scribbles over the input */
+    memset(xdmv_analysis.in, 0, sizeof(*xdmv_analysis.in) * xdmv_sample_rate * rows);
+
+    xdmv_analysis_configure(&xdmv_quality[0]);
+}
+
+void
+xdmv_governor_account(enum stage stage, unsigned long *since)
+{
+    /* Charge the time since *since to a stage and restart the clock */
+    unsigned long now = gettime_us();
+    xdmv_governor.frame[stage] += now - *since;
+    *since = now;
+}
+
+double
+xdmv_governor_budget(int level)
+{
+    /* usec available per frame at a quality level */
+    int fps = xdmv_quality[level].framerate;
+    double budget = xdmv_frame_budget * 1000.0 * xdmv_framerate / fps;
+    return fmin(budget, 1000000.0 / fps);
+}
+
+void
+xdmv_governor_publish(Display *d, Window w)
+{
+    /* let other programs see what we are currently running at, removed
+     * again in xdmv_xorg_cleanup */
+    long level = xdmv_governor.level;
+    Atom xa = XInternAtom(d, "_XDMV_QUALITY", False);
+    XChangeProperty(d, w, xa, XA_CARDINAL, 32, PropModeReplace,
+            (unsigned char *) &level, 1);
+}
+
+void
+xdmv_governor_apply(Display *d, Window w)
+{
+    const struct quality *q = &xdmv_quality[xdmv_governor.level];
+    xdmv_analysis_configure(q);
+    for (struct output_list *ol = xdmv.output_list; ol; ol = ol->next)
+        for (int i = 0; i < ol->nspectrums; i++)
+            xdmv_spectrum_configure(&ol->spectrums[i], q);
+
+    xdmv_governor_publish(d, w);
+}
+
+int
+xdmv_governor_update(Display *d, Window w)
+{
+    /* Called once per frame. Returns non zero if the quality level changed. */
+    double total = 0;
+    for (int i = 0; i < stage_count; i++) {
+        xdmv_governor.avg[i] += (xdmv_governor.frame[i] - xdmv_governor.avg[i]) / 16;
+        xdmv_governor.frame[i] = 0;
+        total += xdmv_governor.avg[i];
+    }
+
+    if (xdmv_governor.hold > 0) {
+        xdmv_governor.hold--;
+        return 0;
+    }
+
+    int level = xdmv_governor.level;
+    if (level < xdmv_quality_levels - 1 &&
+            total > xdmv_governor_down * xdmv_governor_budget(level))
+        level++;
+    else if (level > 0 &&
+            total < xdmv_governor_up * xdmv_governor_budget(level - 1))
+        level--;
+
+    if (level == xdmv_governor.level)
+        return 0;
+
+    eprintf("quality %d -> %d (%.0fus/frame: input %.0f fft %.0f filter %.0f "
+            "render %.0f swap %.0f)\n", xdmv_governor.level, level, total,
+            xdmv_governor.avg[stage_input], xdmv_governor.avg[stage_fft],
+            xdmv_governor.avg[stage_filter], xdmv_governor.avg[stage_render],
+            xdmv_governor.avg[stage_swap]);
+    xdmv_governor.level = level;
+    xdmv_governor.hold = xdmv_governor_hold;
+    xdmv_governor_apply(d, w);
+
+    return 1;
+}
+
+Picture
+xdmv_xrender_tile(Display *d, int spacing, int width, int height,
+        enum edge edge)
+{
+    /* Built once per bar size and edge, bars grow away from row 0 at the top
+     * and towards the last row at the bottom. Tiles are as tall as the
+     * monitor so no bar is tall enough to wrap around; past xdmv_height the
+     * gradient stays at its tip alpha. */
+    for (int i = 0; i < xdmv_xrender.ntiles; i++) {
+        struct tile *tile = &xdmv_xrender.tiles[i];
+        if (tile->spacing == spacing && tile->width == width &&
+                tile->height == height && tile->edge == edge)
+            return tile->picture;
+    }
+
+    struct tile *tile;
+    if (xdmv_xrender.ntiles < xdmv_max_tiles) {
+        tile = &xdmv_xrender.tiles[xdmv_xrender.ntiles++];
+    } else {
+        tile = &xdmv_xrender.tiles[xdmv_xrender.evict++ % xdmv_max_tiles];
+        XRenderFreePicture(d, tile->picture);
+    }
+
+    XRenderPictFormat *fmt = XRenderFindStandardFormat(d, PictStandardARGB32);
+    Pixmap pm = XCreatePixmap(d, DefaultRootWindow(d), spacing, height, 32);
+    XRenderPictureAttributes pa = { .repeat = RepeatNormal };
+    Picture pic = XRenderCreatePicture(d, pm, fmt, CPRepeat, &pa);
+    XFreePixmap(d, pm);
+
+    XRenderColor clear = { 0 };
+    XRenderFillRectangle(d, PictOpSrc, pic, &clear, 0, 0, spacing, height);
+    int ramp = min(height, xdmv_height);
+    for (int i = 0; i <= ramp; i++) {
+        /* the last step covers everything beyond the gradient */
+        int dist = min(i, xdmv_height - 1);
+        int h = i < ramp ? 1 : height - ramp;
+        int y = edge == edge_top ? i : height - i - h;
+        if (h <= 0)
+            break;
+        unsigned int a = xdmv_bar_alpha_base + (xdmv_bar_alpha_tip -
+                xdmv_bar_alpha_base) * dist / (xdmv_height - 1);
+        /* premultiplied */
+        XRenderColor c = {
+            .red   = (xdmv_box_color >> 16 & 0xff) * a,
+            .green = (xdmv_box_color >> 8 & 0xff) * a,
+            .blue  = (xdmv_box_color & 0xff) * a,
+            .alpha = a * 0x101,
+        };
+        XRenderFillRectangle(d, PictOpSrc, pic, &c, 0, y, min(width, spacing), h);
+    }
+
+    *tile = (struct tile){ spacing, width, height, edge, pic };
+    return pic;
+}
+
+void
+xdmv_xrender_spectrum(Display *d, Window w, Spectrum *sp, int offx,
+        int width, int height, int base, enum edge edge)
+{
+    /* All bars of a spectrum as trapezoids over one repeating tile, alpha
+     * blended onto whatever is in the back buffer */
+    if (!xdmv_xrender.dst) {
+        XRenderPictFormat *fmt = XRenderFindVisualFormat(d,
+                DefaultVisual(d, DefaultScreen(d)));
+        xdmv_xrender.dst = XRenderCreatePicture(d, w, fmt, 0, NULL);
+        xdmv_xrender.mask = XRenderFindStandardFormat(d, PictStandardA8);
+    }
+
+    int spacing = width / sp->bars;
+    int left = offx + xdmv_padding_x;
+    Picture tile = xdmv_xrender_tile(d, spacing, sp->box_width, height, edge);
+
+    XTrapezoid *traps = xdmv_xrender.traps;
+    int n = 0;
+    for (int i = 0; i < sp->bars; i++) {
+        /* anything taller than the tile is off the monitor anyway */
+        float boxh = min(sp->f[i] / 4, (float)height);
+        if (boxh <= 0)
+            continue;
+
+        int x = left + spacing * i;
+        float y0 = edge == edge_top ? base : base - boxh;
+        float y1 = edge == edge_top ? base + boxh : base;
+        XTrapezoid *tr = &traps[n++];
+        tr->top = XDoubleToFixed(y0);
+        tr->bottom = XDoubleToFixed(y1);
+        tr->left.p1.x = tr->left.p2.x = XDoubleToFixed(x);
+        tr->right.p1.x = tr->right.p2.x = XDoubleToFixed(x + sp->box_width);
+        tr->left.p1.y = tr->right.p1.y = tr->top;
+        tr->left.p2.y = tr->right.p2.y = tr->bottom;
+    }
+    if (!n)
+        return;
+
+    /* the source lines up with the first point of the first trapezoid,
+     * shift it so the tile starts at the spectrum's left edge and base */
+    int origin_y = edge == edge_top ? base : base - height;
+    int src_x = (int)floor(XFixedToDouble(traps[0].left.p1.x)) - left;
+    int src_y = (int)floor(XFixedToDouble(traps[0].left.p1.y)) - origin_y;
+
+    XRenderCompositeTrapezoids(d, PictOpOver, tile, xdmv_xrender.dst,
+            xdmv_xrender.mask, src_x, src_y, traps, n);
+}
+
 void
 xdmv_render_spectrum_top(Display *d, int s, Window w, Pixmap bg,
-        unsigned int t, Spectrum *sp, int offx, int offy, int width)
+        unsigned int t, Spectrum *sp, int offx, int offy, int width, int height)
 {
-    xdmv_spectrum_create(d, s, w, bg, t, sp);
+    if (xdmv_backend == backend_xrender) {
+        xdmv_xrender_spectrum(d, w, sp, offx, width, height,
+                offy + xdmv_offset_top, edge_top);
+        XFlush(d);
+        return;
+    }
 
     /* Render */
     for (int i = 0; i < sp->bars; i++) {
@@ -440,7 +1250,7 @@ xdmv_render_spectrum_top(Display *d, int s, Window w, Pixmap bg,
 
         xdmv_render_box(d, s, w, offx + width / sp->bars * i + xdmv_padding_x,
                                  offy + xdmv_offset_top,
-                                 xdmv_box_size,
+                                 sp->box_width,
                                  boxh);
     }
     XFlush(d);
@@ -450,7 +1260,12 @@ void
 xdmv_render_spectrum_bot(Display *d, int s, Window w, Pixmap bg,
         unsigned int t, Spectrum *sp, int offx, int offy, int width, int height)
 {
-    xdmv_spectrum_create(d, s, w, bg, t, sp);
+    if (xdmv_backend == backend_xrender) {
+        xdmv_xrender_spectrum(d, w, sp, offx, width, height,
+                offy + height - xdmv_offset_bot, edge_bot);
+        XFlush(d);
+        return;
+    }
 
     /* Render */
     for (int i = 0; i < sp->bars; i++) {
@@ -458,76 +1273,620 @@ xdmv_render_spectrum_bot(Display *d, int s, Window w, Pixmap bg,
 
         xdmv_render_box(d, s, w, offx + width / sp->bars * i + xdmv_padding_x,
                                  offy + height - boxh - xdmv_offset_bot,
-                                 xdmv_box_size,
+                                 sp->box_width,
                                  boxh);
     }
     XFlush(d);
 }
 
+unsigned long xdmv_waterfall_lut[256];
+
+unsigned long
+xdmv_pixel(Visual *v, unsigned int rgb)
+{
+    /* 0xRRGGBB to a pixel value of a TrueColor visual */
+    unsigned long mask[3] = { v->red_mask, v->green_mask, v->blue_mask };
+    unsigned long pixel = 0;
+
+    for (int c = 0; c < 3; c++) {
+        unsigned long value = rgb >> (16 - c * 8) & 0xff;
+        int shift = __builtin_ctzl(mask[c]);
+        pixel |= (value * (mask[c] >> shift) / 0xff) << shift;
+    }
+
+    return pixel;
+}
+
+void
+xdmv_waterfall_init(Display *d, int s, Spectrum *sp, int monitor_height)
+{
+    Visual *v = DefaultVisual(d, s);
+    int depth = DefaultDepth(d, s);
+    dieif(v->class != TrueColor, "Waterfall needs a TrueColor visual");
+
+    /* black through xdmv_box_color to white, computed once */
+    static int lut_ready;
+    if (!lut_ready) {
+        unsigned int stops[3] = { 0x000000, xdmv_box_color, 0xffffff };
+        int n = sizeof xdmv_waterfall_lut / sizeof *xdmv_waterfall_lut;
+        for (int i = 0; i < n; i++) {
+            int half = i * 2 >= n;
+            float k = (float)(i * 2 - half * n) / n;
+            unsigned int rgb = 0;
+            for (int shift = 0; shift < 24; shift += 8) {
+                int from = stops[half] >> shift & 0xff;
+                int to = stops[half + 1] >> shift & 0xff;
+                rgb |= (unsigned int)(from + (to - from) * k) << shift;
+            }
+            xdmv_waterfall_lut[i] = xdmv_pixel(v, rgb);
+        }
+        lut_ready = 1;
+    }
+
+    sp->height = xdmv_waterfall_height;
+    sp->y = (monitor_height - sp->height) / 2;
+    sp->history = XCreatePixmap(d, RootWindow(d, s), sp->width, sp->height,
+            depth);
+    sp->row = XCreateImage(d, v, depth, ZPixmap, 0, NULL, sp->width,
+            xdmv_waterfall_step, 32, 0);
+    dieifnull(sp->row, "Could not create waterfall row");
+    sp->row->data = xmalloc(sp->row->bytes_per_line * xdmv_waterfall_step);
+
+    GC gc = DefaultGC(d, s);
+    XGCValues old;
+    XGetGCValues(d, gc, GCForeground, &old);
+    XSetForeground(d, gc, xdmv_waterfall_lut[0]);
+    XFillRectangle(d, sp->history, gc, 0, 0, sp->width, sp->height);
+    XSetForeground(d, gc, old.foreground);
+}
+
+void
+xdmv_render_spectrum_waterfall(Display *d, int s, Window w, Pixmap bg,
+        unsigned int t, Spectrum *sp, int offx, int offy)
+{
+    /* Scroll the history down on the server and only send the newest row,
+     * so the cost doesn't depend on how much history there is */
+    static GC gc;
+    if (!gc) {
+        XGCValues v = { .graphics_exposures = False };
+        gc = XCreateGC(d, sp->history, GCGraphicsExposures, &v);
+    }
+
+    XImage *row = sp->row;
+    int width = sp->width, height = sp->height;
+    int colors = sizeof xdmv_waterfall_lut / sizeof *xdmv_waterfall_lut;
+
+    for (int x = 0; x < width; x++)
+        XPutPixel(row, x, 0, xdmv_waterfall_lut[0]);
+    for (int i = 0; i < sp->bars; i++) {
+        int c = sp->f[i] / 4 * colors / xdmv_height;
+        unsigned long pixel = xdmv_waterfall_lut[max(0, min(c, colors - 1))];
+        int x = width / sp->bars * i + xdmv_padding_x;
+        for (int j = 0; j < sp->box_width && x + j < width; j++)
+            XPutPixel(row, x + j, 0, pixel);
+    }
+    for (int y = 1; y < xdmv_waterfall_step; y++)
+        memcpy(row->data + y * row->bytes_per_line, row->data,
+                row->bytes_per_line);
+
+    XCopyArea(d, sp->history, sp->history, gc, 0, 0, width,
+            height - xdmv_waterfall_step, 0, xdmv_waterfall_step);
+    XPutImage(d, sp->history, gc, row, 0, 0, 0, 0, width, xdmv_waterfall_step);
+    XCopyArea(d, sp->history, w, gc, 0, 0, width, height, offx, offy);
+    XFlush(d);
+}
+
 void
 xdmv_render_spectrums(Display *d, int s, Window w, Pixmap bg, unsigned long t, struct output_list *ol)
 {
     XRRCrtcInfo *crtc = ol->crtc;
-    int width = crtc->width, height = crtc->height, offx = crtc->x, offy = crtc->y;
-    size_t offset;
+    int height = crtc->height, offx = crtc->x, offy = crtc->y;
+    unsigned long st = gettime_us();
+
+    for (int i = 0; i < ol->nspectrums; i++)
+        xdmv_spectrum_create(d, s, w, bg, t, &ol->spectrums[i]);
+    xdmv_governor_account(stage_filter, &st);
+
+    if (xdmv_replay.bars)
+        for (int i = 0; i < ol->nspectrums; i++)
+            fwrite(ol->spectrums[i].f, sizeof(float), ol->spectrums[i].bars,
+                    xdmv_replay.bars);
+
+    for (int i = 0; i < ol->nspectrums; i++) {
+        Spectrum *sp = &ol->spectrums[i];
+        if (sp->edge == edge_top)
+            xdmv_render_spectrum_top(d, s, w, bg, t, sp, offx + sp->x, offy,
+                    sp->width, height);
+        else if (sp->edge == edge_bot)
+            xdmv_render_spectrum_bot(d, s, w, bg, t, sp, offx + sp->x, offy,
+                    sp->width, height);
+        else
+            xdmv_render_spectrum_waterfall(d, s, w, bg, t, sp, offx + sp->x,
+                    offy + sp->y);
+    }
+    xdmv_governor_account(stage_render, &st);
+}
 
-    Spectrum *sl = &ol->spectruml;
-    Spectrum *sr = &ol->spectrumr;
+void
+xdmv_layout_init(Display *d, int s, struct output_list *ol, int index)
+{
+    /* Pick the layout entries for this monitor and split each edge between
+     * the spectrums on it */
+    int n = 0, count[edge_count] = {0}, pos[edge_count] = {0};
+    ol->spectrums = xmalloc(sizeof *ol->spectrums * xdmv_layout_count);
+
+    for (int i = 0; i < xdmv_layout_count; i++) {
+        struct layout *l = &xdmv_layout[i];
+        if (l->output != -1 && l->output != index)
+            continue;
+        if (l->channel >= xdmv_analysis.channels) {
+            eprintf("layout: no channel %d in a %d channel stream\n",
+                    l->channel, xdmv_analysis.channels);
+            continue;
+        }
 
-    switch (xdmv_source) {
-        case source_file_wav:
-            offset = xdmv.sample_rate * t / 1000;
-            for (size_t i = 0; i < xdmv_sample_rate; i++) {
-                sl->in[i] = xdmv_wav_audio[offset + i].l;
-                sr->in[i] = xdmv_wav_audio[offset + i].r;
-            }
+        Spectrum *sp = &ol->spectrums[n++];
+        memset(sp, 0, sizeof *sp);
+        int row = l->channel == xdmv_channel_downmix ?
+            xdmv_analysis.channels : l->channel;
+        sp->out = xdmv_analysis.out + row * xdmv_out_stride;
+        sp->edge = l->edge;
+        count[sp->edge]++;
+    }
+    ol->nspectrums = n;
+
+    for (int i = 0; i < n; i++) {
+        Spectrum *sp = &ol->spectrums[i];
+        int width = ol->crtc->width / count[sp->edge];
+        sp->x = width * pos[sp->edge]++;
+        sp->width = width;
+        sp->maxbars = min((width - xdmv_padding_x * 2) / (xdmv_box_size + xdmv_box_margin),
+                xdmv_max_bars);
+        if (sp->edge == edge_waterfall)
+            xdmv_waterfall_init(d, s, sp, ol->crtc->height);
+        xdmv_spectrum_configure(sp, &xdmv_quality[0]);
+        xdmv_spectrum_print(sp);
+    }
+}
+
+void
+xdmv_analysis_run(unsigned long t)
+{
+    unsigned long st = gettime_us();
+    xdmv_analysis_load(t);
+    xdmv_governor_account(stage_input, &st);
+
+    fftw_execute(xdmv_analysis.p);
+    xdmv_governor_account(stage_fft, &st);
+}
+
+void *
+xdmv_record_process(void *arg)
+{
+    /* Write-behind: everything but the write itself happens under the lock */
+    pthread_mutex_lock(&xdmv_record.lock);
+    for (;;) {
+        while (!xdmv_record.full && !xdmv_record.stop)
+            pthread_cond_wait(&xdmv_record.cond, &xdmv_record.lock);
+
+        int b;
+        if (xdmv_record.full)
+            b = xdmv_record.tail;
+        else if (xdmv_record.used[xdmv_record.head])
+            b = xdmv_record.head;
+        else
             break;
-        case source_jack:
-            offset = xdmv.sample_rate * t / 4000;
-            for (size_t i = 0; i < xdmv_sample_rate; i++) {
-                sl->in[i] = xdmv_jack.bufl[(offset + i) % xdmv_sample_rate] * 65536;
-                sr->in[i] = xdmv_jack.bufr[(offset + i) % xdmv_sample_rate] * 65536;
+        pthread_mutex_unlock(&xdmv_record.lock);
+
+        for (size_t off = 0; off < xdmv_record.used[b]; ) {
+            ssize_t n = write(xdmv_record.fd, xdmv_record.buf[b] + off,
+                    xdmv_record.used[b] - off);
+            if (n < 0) {
+                perror("write");
+                die("Could not write recording");
             }
+            off += n;
+        }
+
+        pthread_mutex_lock(&xdmv_record.lock);
+        xdmv_record.used[b] = 0;
+        if (b == xdmv_record.tail && xdmv_record.full) {
+            xdmv_record.tail = (b + 1) % xdmv_record_buffers;
+            xdmv_record.full--;
+        }
+    }
+    pthread_mutex_unlock(&xdmv_record.lock);
+
+    return NULL;
+}
+
+void
+xdmv_record_open(const char *fn)
+{
+    xdmv_record.fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dieif(xdmv_record.fd < 0, "Could not open recording");
+
+    for (int i = 0; i < xdmv_record_buffers; i++) {
+        xdmv_record.buf[i] = aligned_alloc(4096, xdmv_record_buffer_size);
+        dieifnull(xdmv_record.buf[i], "Could not allocate memory");
+    }
+
+    xdmv_thread_create(&xdmv_record.thread, &xdmv_record_process,
+            "Could not set up recording thread");
+}
+
+void
+xdmv_record_write(uint32_t type, const struct iovec *iov, int n, int wait)
+{
+    /* Append one block. Called from the capture threads, so this must never
+     * wait on the writer: if no buffer is free the block is dropped. The
+     * realtime jack thread passes wait = 0 and also drops the block rather
+     * than wait for the lock. */
+    struct record_block block = { type, 0 };
+    for (int i = 0; i < n; i++)
+        block.size += iov[i].iov_len;
+    size_t need = sizeof block + block.size;
+    if (need > xdmv_record_buffer_size) {
+        __atomic_fetch_add(&xdmv_record.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (wait) {
+        pthread_mutex_lock(&xdmv_record.lock);
+    } else if (pthread_mutex_trylock(&xdmv_record.lock)) {
+        __atomic_fetch_add(&xdmv_record.dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    int b = xdmv_record.head;
+    if (xdmv_record.used[b] + need > xdmv_record_buffer_size) {
+        if (xdmv_record.full == xdmv_record_buffers - 1) {
+            __atomic_fetch_add(&xdmv_record.dropped, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&xdmv_record.lock);
+            return;
+        }
+        xdmv_record.full++;
+        b = xdmv_record.head = (b + 1) % xdmv_record_buffers;
+        pthread_cond_signal(&xdmv_record.cond);
+    }
+
+    char *p = xdmv_record.buf[b] + xdmv_record.used[b];
+    memcpy(p, &block, sizeof block);
+    p += sizeof block;
+    for (int i = 0; i < n; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    xdmv_record.used[b] += need;
+    pthread_mutex_unlock(&xdmv_record.lock);
+}
+
+void
+xdmv_record_begin(void)
+{
+    /* Called by a source right before it starts capturing, once the format
+     * is known. The header goes out as the first buffer contents. */
+    if (xdmv_record.fd < 0)
+        return;
+
+    struct record_header h = {
+        .sample_rate = xdmv.sample_rate,
+        .channels = xdmv_analysis.channels,
+        .source = xdmv_source,
+    };
+    memcpy(h.magic, xdmv_record_magic, sizeof h.magic);
+
+    pthread_mutex_lock(&xdmv_record.lock);
+    memcpy(xdmv_record.buf[xdmv_record.head], &h, sizeof h);
+    xdmv_record.used[xdmv_record.head] = sizeof h;
+    xdmv_record.active = 1;
+    pthread_mutex_unlock(&xdmv_record.lock);
+}
+
+void
+xdmv_record_frame(unsigned long t)
+{
+    if (!xdmv_record.active)
+        return;
+
+    struct record_frame f = {
+        .t = t,
+        .pos = xdmv_source == source_jack ? xdmv_jack.pos : xdmv_pulse.pos,
+        .level = xdmv_governor.level,
+    };
+    struct iovec iov = { &f, sizeof f };
+    xdmv_record_write(record_frame, &iov, 1, 1);
+}
+
+void
+xdmv_record_stop(void)
+{
+    if (xdmv_record.fd < 0)
+        return;
+
+    pthread_mutex_lock(&xdmv_record.lock);
+    xdmv_record.active = 0;
+    xdmv_record.stop = 1;
+    pthread_cond_signal(&xdmv_record.cond);
+    pthread_mutex_unlock(&xdmv_record.lock);
+    pthread_join(xdmv_record.thread, NULL);
+
+    close(xdmv_record.fd);
+    xdmv_record.fd = -1;
+    if (xdmv_record.dropped)
+        eprintf("recording: dropped %lu blocks\n", xdmv_record.dropped);
+}
+
+void
+xdmv_jack_store(unsigned int pos, float **bufs, unsigned int n)
+{
+    /* Shared by the jack callback and replay. Sample 0 of the period is
+     * skipped and the position ends one past the last sample, as it always
+     * has. */
+    for (int c = 0; c < xdmv_analysis.channels; c++)
+        for (unsigned int i = 0; i < n; i++)
+            xdmv_jack.buf[c][(pos + 1 + i) % xdmv_sample_rate] = bufs[c][i];
+    xdmv_jack.pos = pos + n + 1;
+}
+
+void
+xdmv_pulse_store(unsigned int pos, const int16_t *samples, size_t frames)
+{
+    /* Replay of what xdmv_pulse_process read straight into the ring */
+    size_t offset = pos % xdmv_sample_rate;
+    memcpy(xdmv_pulse.buf + offset * xdmv_analysis.channels, samples,
+            frames * xdmv_analysis.channels * sizeof *samples);
+    xdmv_pulse.pos = pos + frames;
+}
+
+void
+xdmv_replay_load(const char *fn)
+{
+    FILE *f = fopen(fn, "r");
+    dieifnull(f, "Could not open recording");
+    fseek(f, 0, SEEK_END);
+    xdmv_replay.size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    xdmv_replay.data = xmalloc(xdmv_replay.size);
+    dieif(fread(xdmv_replay.data, 1, xdmv_replay.size, f) < xdmv_replay.size,
+            "Could not read recording");
+    fclose(f);
+
+    struct record_header h;
+    dieif(xdmv_replay.size < sizeof h, "Recording too short");
+    memcpy(&h, xdmv_replay.data, sizeof h);
+    dieif(memcmp(h.magic, xdmv_record_magic, sizeof h.magic),
+            "Not an xdmv recording");
+    dieif(h.source != source_pulse && h.source != source_jack,
+            "Recording has unknown source");
+    dieif(h.channels < 1 || h.channels > xdmv_max_channels,
+            "Recording has bad channel count");
+
+    xdmv_source = h.source;
+    xdmv.sample_rate = h.sample_rate;
+    xdmv_analysis.channels = h.channels;
+    xdmv_replay.frame = xdmv_replay.audio = sizeof h;
+}
+
+struct record_block *
+xdmv_replay_block(size_t *off, uint32_t type)
+{
+    /* Next block of a type at or after *off, *off is moved past it */
+    while (*off + sizeof(struct record_block) <= xdmv_replay.size) {
+        struct record_block *b = (void *)(xdmv_replay.data + *off);
+        if (*off + sizeof *b + b->size > xdmv_replay.size)
             break;
-        case source_pulse:
-            offset = xdmv.sample_rate * t / 1000;
-            for (size_t i = 0; i < xdmv_sample_rate; i++) {
-                sl->in[i] = xdmv_pulse.buf[(offset + i) % xdmv_sample_rate].l;
-                sr->in[i] = xdmv_pulse.buf[(offset + i) % xdmv_sample_rate].r;
-            }
+        *off += sizeof *b + b->size;
+        if (b->type == type)
+            return b;
+    }
+    *off = xdmv_replay.size;
+    return NULL;
+}
+
+int
+xdmv_replay_next(Display *d, Window w, unsigned long start, unsigned long *t)
+{
+    /* Restore the capture ring and quality level of the next recorded frame.
+     * Returns non zero at the end of the recording. */
+    struct record_block *b = xdmv_replay_block(&xdmv_replay.frame, record_frame);
+    if (!b)
+        return 1;
+    struct record_frame f;
+    dieif(b->size < sizeof f, "Corrupt recording: short frame block");
+    memcpy(&f, b + 1, sizeof f);
+
+    /* the capture thread may have appended its block after the frame, so go
+     * by position rather than file order */
+    int channels = xdmv_analysis.channels;
+    for (;;) {
+        size_t off = xdmv_replay.audio;
+        b = xdmv_replay_block(&off, record_audio);
+        if (!b)
             break;
-        default:
-            die("wtf?");
+
+        uint32_t pos;
+        char *p = (char *)(b + 1);
+        dieif(b->size < sizeof pos, "Corrupt recording: short audio block");
+        memcpy(&pos, p, sizeof pos);
+        if ((int32_t)(pos - f.pos) >= 0)
+            break;
+        xdmv_replay.audio = off;
+        p += sizeof pos;
+
+        /* don't let a damaged file write past the rings */
+        if (xdmv_source == source_pulse) {
+            size_t frame_size = channels * sizeof(int16_t);
+            size_t frames = (b->size - sizeof pos) / frame_size;
+            dieif((b->size - sizeof pos) % frame_size ||
+                    pos % xdmv_sample_rate + frames > xdmv_sample_rate + 256,
+                    "Corrupt recording: bad pulse block");
+            xdmv_pulse_store(pos, (int16_t *)p, frames);
+        } else {
+            uint32_t n;
+            dieif(b->size < sizeof pos + sizeof n,
+                    "Corrupt recording: short jack block");
+            memcpy(&n, p, sizeof n);
+            dieif(sizeof pos + sizeof n + (uint64_t)channels * n * sizeof(float)
+                    != b->size, "Corrupt recording: bad jack block");
+            p += sizeof n;
+            float *bufs[xdmv_max_channels];
+            for (int c = 0; c < channels; c++)
+                bufs[c] = (float *)p + c * n;
+            xdmv_jack_store(pos, bufs, n);
+        }
+    }
+
+    if (f.level != xdmv_governor.level && f.level < xdmv_quality_levels) {
+        xdmv_governor.level = f.level;
+        xdmv_governor_apply(d, w);
     }
 
-    fftw_execute(sl->p);
-    fftw_execute(sr->p);
-    xdmv_render_spectrum_top(d, s, w, bg, t, sl, offx, offy, width);
-    xdmv_render_spectrum_bot(d, s, w, bg, t, sr, offx, offy, width, height);
+    *t = f.t;
+    if (!xdmv_replay.fast) {
+        long wait = start + f.t - gettime();
+        if (wait > 0)
+            xdmv_sleep(wait);
+    }
+
+    return 0;
+}
+
+int
+xdmv_bench_server_ticks(unsigned long *ticks)
+{
+    /* utime + stime of the X server, if we know which process it is and it
+     * is still around. Returns non zero otherwise. */
+    if (!xdmv_bench.server)
+        return -1;
+
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/stat", (int)xdmv_bench.server);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    unsigned long utime = 0, stime = 0;
+    /* comm may contain spaces, skip past its closing paren */
+    int n = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+            "%*u %lu %lu", &utime, &stime);
+    fclose(f);
+
+    if (n != 2)
+        return -1;
+    *ticks = utime + stime;
+    return 0;
 }
 
 void
-xdmv_xorg_cleanup(void)
+xdmv_bench_io(unsigned long long *wchar, unsigned long long *rchar,
+        unsigned long long *syscr)
 {
-    XdbeSwapBuffers(xdmv.display, &xdmv.swapinfo, 1);
-    XFlush(xdmv.display);
-    XCloseDisplay(xdmv.display);
+    /* our own socket traffic, nothing else is read or written while the
+     * benchmark runs */
+    FILE *f = fopen("/proc/self/io", "r");
+    *wchar = *rchar = *syscr = 0;
+    if (!f)
+        return;
+
+    char key[32];
+    unsigned long long value;
+    while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (!strcmp(key, "wchar"))
+            *wchar = value;
+        else if (!strcmp(key, "rchar"))
+            *rchar = value;
+        else if (!strcmp(key, "syscr"))
+            *syscr = value;
+    }
+    fclose(f);
+}
+
+void
+xdmv_bench_parse_outputs(const char *arg)
+{
+    /* WxH+X+Y[,WxH+X+Y...] */
+    while (*arg) {
+        dieif(xdmv_bench.noutputs == xdmv_bench_max_outputs, "Too many outputs");
+        XRRCrtcInfo *c = &xdmv_bench.outputs[xdmv_bench.noutputs++];
+        int n = 0;
+        dieif(sscanf(arg, "%ux%u+%d+%d%n", &c->width, &c->height, &c->x,
+                    &c->y, &n) != 4, "Bad output, expected WxH+X+Y");
+        arg += n;
+        if (*arg == ',')
+            arg++;
+    }
 }
 
 void
-xdmv_fftw_init(Spectrum *s)
+xdmv_bench_begin(Display *d)
 {
-    s->in = fftw_malloc(sizeof(*s->in) * xdmv_sample_rate);
-    s->out = fftw_malloc(sizeof(*s->out) * xdmv_sample_rate);
-    s->p = fftw_plan_dft_r2c_1d(xdmv_sample_rate, s->in, s->out, FFTW_MEASURE);
+    if (!xdmv_bench.frames)
+        return;
+
+    XSync(d, False);
+    getrusage(RUSAGE_SELF, &xdmv_bench.usage);
+    xdmv_bench.server_ok = !xdmv_bench_server_ticks(&xdmv_bench.server_ticks);
+    xdmv_bench.request = NextRequest(d);
+    xdmv_bench_io(&xdmv_bench.wchar, &xdmv_bench.rchar, &xdmv_bench.syscr);
+}
+
+void
+xdmv_bench_end(Display *d, unsigned long frames)
+{
+    if (!xdmv_bench.frames || !frames)
+        return;
+
+    /* let the server catch up so its cpu time is complete */
+    XSync(d, False);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    unsigned long server_ticks = 0;
+    int server_ok = xdmv_bench.server_ok && !xdmv_bench_server_ticks(&server_ticks);
+    unsigned long request = NextRequest(d);
+    unsigned long long wchar, rchar, syscr;
+    xdmv_bench_io(&wchar, &rchar, &syscr);
+
+    struct rusage *u = &xdmv_bench.usage;
+    double client = (usage.ru_utime.tv_sec - u->ru_utime.tv_sec) * 1e6 +
+                    (usage.ru_utime.tv_usec - u->ru_utime.tv_usec) +
+                    (usage.ru_stime.tv_sec - u->ru_stime.tv_sec) * 1e6 +
+                    (usage.ru_stime.tv_usec - u->ru_stime.tv_usec);
+    double server = (double)(server_ticks - xdmv_bench.server_ticks) *
+                    1e6 / sysconf(_SC_CLK_TCK);
+
+    int outputs = 0;
+    for (struct output_list *ol = xdmv.output_list; ol; ol = ol->next)
+        outputs++;
+
+    /* one line per run, per frame figures */
+    printf("backend=%s frames=%lu outputs=%d client_us=%.1f server_us=%.1f "
+           "requests=%.1f bytes_out=%.1f bytes_in=%.1f reads=%.2f\n",
+           xdmv_backend_names[xdmv_backend], frames, outputs,
+           client / frames, server_ok ? server / frames : -1.0,
+           (double)(request - xdmv_bench.request) / frames,
+           (double)(wchar - xdmv_bench.wchar) / frames,
+           (double)(rchar - xdmv_bench.rchar) / frames,
+           (double)(syscr - xdmv_bench.syscr) / frames);
+    fflush(stdout);
+}
+
+void
+xdmv_xorg_cleanup(void)
+{
+    xdmv_record_stop();
+    XDeleteProperty(xdmv.display, XDefaultRootWindow(xdmv.display),
+            XInternAtom(xdmv.display, "_XDMV_QUALITY", False));
+    if (xdmv_feature_export.enabled)
+        XDeleteProperty(xdmv.display, XDefaultRootWindow(xdmv.display),
+                XInternAtom(xdmv.display, "_XDMV_FEATURES", False));
+    XdbeSwapBuffers(xdmv.display, &xdmv.swapinfo, 1);
+    XFlush(xdmv.display);
+    XCloseDisplay(xdmv.display);
 }
 
 int
-xdmv_xorg(int argc, char **argv)
+xdmv_xorg(const char *display_name)
 {
-    char *display_name = NULL;
-    if (argc > 2)
-        display_name = argv[2];
     xdmv.display = XOpenDisplay(display_name);
     dieifnull(xdmv.display, "Cannot open display");
     Display *display = xdmv.display;
@@ -542,24 +1901,24 @@ xdmv_xorg(int argc, char **argv)
     XRRScreenResources *sr = xdmv.screenresources;
     struct output_list **ol = &xdmv.output_list;
     *ol = xmalloc(sizeof **ol);
+    xdmv_analysis_init();
+    /* faked monitors for benchmarking */
+    for (int i = 0; i < xdmv_bench.noutputs; i++) {
+        (*ol)->info = NULL;
+        (*ol)->crtc = &xdmv_bench.outputs[i];
+        (*ol)->next = xmalloc(sizeof **ol);
+        xdmv_layout_init(display, DefaultScreen(display), *ol, i);
+        ol = &(*ol)->next;
+    }
     /* go through monitors */
-    for (int i = 0; i < sr->noutput; i++) {
+    for (int i = 0, o = 0; !xdmv_bench.noutputs && i < sr->noutput; i++) {
         XRROutputInfo *info;
         info = XRRGetOutputInfo(display, sr, sr->outputs[i]);
         if (info->connection == RR_Connected) {
             (*ol)->info = info;
             (*ol)->crtc = XRRGetCrtcInfo(display, sr, info->crtc);
             (*ol)->next = xmalloc(sizeof **ol);
-            xdmv_fftw_init(&(*ol)->spectruml);
-            xdmv_fftw_init(&(*ol)->spectrumr);
-            XRRCrtcInfo *crtc = (*ol)->crtc;
-            Spectrum *sl = &(*ol)->spectruml;
-            Spectrum *sr = &(*ol)->spectrumr;
-            int width = crtc->width;
-            int bars = (width - xdmv_padding_x * 2) / (xdmv_box_size + xdmv_box_margin);
-            sl->bars = sr->bars = bars;
-            xdmv_spectrum_calculate(sl);
-            xdmv_spectrum_calculate(sr);
+            xdmv_layout_init(display, DefaultScreen(display), *ol, o++);
             ol = &(*ol)->next;
         }
     }
@@ -570,6 +1929,9 @@ xdmv_xorg(int argc, char **argv)
     Window window = xdmv.window;
     int s = xdmv.screen;
 
+    /* replace whatever level a previous run left behind */
+    xdmv_governor_publish(display, window);
+
     XMapWindow(display, window);
 
     /* set up double buffering */
@@ -585,29 +1947,57 @@ xdmv_xorg(int argc, char **argv)
     unsigned long start = gettime(), loop_start = 0;
     unsigned long wav_end = xdmv.song_length * 1000 -
                         xdmv_sample_rate * 1000 / xdmv.sample_rate;
-    for (;;) {
+    unsigned long frame;
+    xdmv_bench_begin(display);
+    xdmv_running = 1;
+    for (frame = 0; !xdmv_quit; frame++) {
         loop_start = gettime();
         unsigned long cur = loop_start - start;
-        if (xdmv.song_length > 0 && cur > wav_end)
+        if (xdmv_bench.frames) {
+            if (frame == xdmv_bench.frames)
+                break;
+            cur = frame * 1000 / xdmv_framerate;
+        }
+        if (xdmv_replay.data) {
+            if (xdmv_replay_next(display, window, start, &cur))
+                break;
+        } else if (xdmv.song_length > 0 && cur > wav_end) {
             break;
+        }
 
+        xdmv_record_frame(cur);
+        xdmv_analysis_run(cur);
         for (struct output_list *ol = xdmv.output_list; ol; ol = ol->next) {
             xdmv_render_spectrums(display, s, xdmv.backbuffer, xdmv.bg, cur, ol);
         }
+        if (xdmv_feature_export.enabled && xdmv.output_list)
+            xdmv_features_publish(display, window, xdmv.output_list);
+        unsigned long st = gettime_us();
         XdbeSwapBuffers(display, &xdmv.swapinfo, 1);
-
-        unsigned int next = 1000 / xdmv_framerate;
+        xdmv_governor_account(stage_swap, &st);
+        /* replay paces itself and takes the recorded quality levels, the
+         * benchmark doesn't wait at all */
+        if (xdmv_replay.data || xdmv_bench.frames)
+            continue;
+        xdmv_governor_update(display, window);
+
+        unsigned int next = 1000 / xdmv_quality[xdmv_governor.level].framerate;
         long elapsed = gettime() - loop_start;
         if (elapsed < next)
             xdmv_sleep(next - elapsed);
     }
+    xdmv_bench_end(display, frame);
 
     xdmv_xorg_cleanup();
+    if (xdmv_quit) {
+        signal(xdmv_quit, SIG_DFL);
+        raise(xdmv_quit);
+    }
     return 0;
 }
 
 int
-xdmv_loadwav(FILE *f, struct wav_header *h, struct sample **samples)
+xdmv_loadwav(FILE *f, struct wav_header *h, int16_t **samples)
 {
     /* I don't care about endianness and do basic validation only */
 
@@ -621,7 +2011,8 @@ xdmv_loadwav(FILE *f, struct wav_header *h, struct sample **samples)
 
     /* support only these properties for now */
     if (h->bits_per_sample != 16)    return -1;
-    if (h->channels != 2)            return -1;
+    if (h->channels < 1)             return -1;
+    if (h->channels > xdmv_max_channels) return -1;
 
     /* read until data chunk */
     struct wav_header_chunk hc;
@@ -636,6 +2027,7 @@ xdmv_loadwav(FILE *f, struct wav_header *h, struct sample **samples)
     unsigned int sz = hc.size;
     xdmv.song_length = sz * 8 / h->bits_per_sample / h->channels / h->sample_rate;
     xdmv.sample_rate = h->sample_rate;
+    xdmv_analysis.channels = h->channels;
 
     *samples = xmalloc(sz);
     if (fread(*samples, 1, sz, f) < sz)
@@ -647,17 +2039,23 @@ xdmv_loadwav(FILE *f, struct wav_header *h, struct sample **samples)
 int
 xdmv_jack_process(jack_nframes_t nframes, void *arg)
 {
-    float *bufl = jack_port_get_buffer(xdmv_jack.port_l, nframes);
-    float *bufr = jack_port_get_buffer(xdmv_jack.port_r, nframes);
-
-    unsigned int i = 0;
+    int channels = xdmv_analysis.channels;
     unsigned int pos = xdmv_jack.pos;
-    nframes /= 4;
-    while(i++, pos++, nframes--) {
-        xdmv_jack.bufl[pos % xdmv_sample_rate] = bufl[i];
-        xdmv_jack.bufr[pos % xdmv_sample_rate] = bufr[i];
+    uint32_t n = nframes / 4;
+    float *bufs[xdmv_max_channels];
+    for (int c = 0; c < channels; c++)
+        bufs[c] = (float *)jack_port_get_buffer(xdmv_jack.port[c], nframes) + 1;
+    xdmv_jack_store(pos, bufs, n);
+
+    if (xdmv_record.active) {
+        struct iovec iov[2 + xdmv_max_channels] = {
+            { &pos, sizeof pos },
+            { &n, sizeof n },
+        };
+        for (int c = 0; c < channels; c++)
+            iov[2 + c] = (struct iovec){ bufs[c], n * sizeof **bufs };
+        xdmv_record_write(record_audio, iov, 2 + channels, 0);
     }
-    xdmv_jack.pos = pos;
 
     return 0;
 }
@@ -681,17 +2079,22 @@ xdmv_jack_init()
     jack_set_process_callback(client, &xdmv_jack_process, 0);
     jack_set_sample_rate_callback(client, &xdmv_jack_sample_rate, 0);
 
-    jack_port_t *l = jack_port_register(client, "xdmv_l",
-            JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput,
-            xdmv_sample_rate);
-    jack_port_t *r = jack_port_register(client, "xdmv_r",
-            JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput,
-            xdmv_sample_rate);
-    assert(l && r);
-    xdmv_jack.port_l = l;
-    xdmv_jack.port_r = r;
+    /* wav channel order */
+    static const char *names[xdmv_max_channels] = {
+        "xdmv_l", "xdmv_r", "xdmv_c", "xdmv_lfe",
+        "xdmv_bl", "xdmv_br", "xdmv_sl", "xdmv_sr",
+    };
+    for (int c = 0; c < xdmv_capture_channels; c++) {
+        xdmv_jack.port[c] = jack_port_register(client, names[c],
+                JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput,
+                xdmv_sample_rate);
+        assert(xdmv_jack.port[c]);
+    }
+    xdmv_analysis.channels = xdmv_capture_channels;
 
     xdmv.sample_rate = jack_get_sample_rate(client);
+    xdmv_source = source_jack;
+    xdmv_record_begin();
 
     jack_activate(client);
 
@@ -705,7 +2108,7 @@ xdmv_pulse_process(void *arg)
     pa_simple *s;
     pa_sample_spec ss;
     ss.format = PA_SAMPLE_S16NE;
-    ss.channels = 2;
+    ss.channels = xdmv_capture_channels;
     ss.rate = 44100;
     s = pa_simple_new(NULL,   // Use the default server.
             "xdmv",           // Our application's name.
@@ -724,19 +2127,31 @@ xdmv_pulse_process(void *arg)
 
     xdmv_pulse.s = s;
     xdmv.sample_rate = ss.rate;
+    xdmv_analysis.channels = ss.channels;
+    xdmv_source = source_pulse;
+    xdmv_record_begin();
 
     /* bytes */
     const size_t chunk_size = xdmv_sample_rate / xdmv_framerate;
     xdmv_pulse.status = 1;
     for(;;) {
         size_t offset = xdmv_pulse.pos % xdmv_sample_rate;
-        int16_t *b = (int16_t *)(xdmv_pulse.buf + offset);
+        int16_t *b = xdmv_pulse.buf + offset * ss.channels;
         int errnum;
-        int err = pa_simple_read(xdmv_pulse.s, b, chunk_size * 4, &errnum);
+        int err = pa_simple_read(xdmv_pulse.s, b,
+                chunk_size * ss.channels * sizeof *b, &errnum);
         if (err < 0) {
             eprintf("pa_simple_read: %d\n", errnum);
             die("");
         }
+        if (xdmv_record.active) {
+            uint32_t pos = xdmv_pulse.pos;
+            struct iovec iov[2] = {
+                { &pos, sizeof pos },
+                { b, chunk_size * ss.channels * sizeof *b },
+            };
+            xdmv_record_write(record_audio, iov, 2, 1);
+        }
         xdmv_pulse.pos += chunk_size;
     }
     return NULL;
@@ -745,11 +2160,8 @@ xdmv_pulse_process(void *arg)
 int
 xdmv_pulse_init()
 {
-    int n = pthread_create(&xdmv_pulse.thread, NULL, &xdmv_pulse_process, NULL);
-    if (n) {
-        perror("pthread");
-        die("Could not set up pulse input thread");
-    }
+    xdmv_thread_create(&xdmv_pulse.thread, &xdmv_pulse_process,
+            "Could not set up pulse input thread");
 
     while (!xdmv_pulse.status)
         xdmv_sleep(100);
@@ -761,9 +2173,11 @@ xdmv_pulse_init()
 }
 
 void
-xdmv_load_sources(int argc, char **argv)
+xdmv_load_sources(int argc, char **argv, const char *replay)
 {
-    if (argc >= 2) {
+    if (replay) {
+        xdmv_replay_load(replay);
+    } else if (argc >= 2) {
         const char *fn = argv[1];
         FILE *f = fopen(fn, "r");
         dieifnull(f, "Could not open music file");
@@ -774,6 +2188,7 @@ xdmv_load_sources(int argc, char **argv)
         dieif(n < 0, "Could not load music file");
         fclose(f);
         xdmv_source = source_file_wav;
+        dieif(xdmv_record.fd >= 0, "Only pulse and jack input can be recorded");
     } else if (!xdmv_pulse_init()) {
         xdmv_source = source_pulse;
     } else if (!xdmv_jack_init()) {
@@ -786,9 +2201,14 @@ xdmv_load_sources(int argc, char **argv)
 void
 sig_handler(int n)
 {
-    xdmv_xorg_cleanup();
-    signal(n, SIG_DFL);
-    raise(n);
+    /* Only flag it once the render loop runs, cleanup takes locks and
+     * joins threads, which can't happen in here */
+    if (!xdmv_running) {
+        signal(n, SIG_DFL);
+        raise(n);
+        return;
+    }
+    xdmv_quit = n;
 }
 
 void
@@ -813,11 +2233,84 @@ xdmv_signal_init(void)
     sigaction(SIGSEGV, &sa, 0);
 }
 
+void
+usage(const char *name)
+{
+    eprintf("usage: %s [-r recording] [-b bars] [-f] [-R backend] "
+            "[-n frames [-M outputs] [-S server pid]] [file.wav [display]]\n"
+            "       %s -p recording [-F] [-b bars] [-f] [-R backend] "
+            "[display]\n"
+            "  -r  record the capture stream and frame timings\n"
+            "  -p  replay a recording instead of capturing\n"
+            "  -F  replay as fast as possible\n"
+            "  -b  write the bar heights of every frame to a file\n"
+            "  -f  publish the first monitor's features as _XDMV_FEATURES\n"
+            "  -R  render backend: core, xrender\n"
+            "  -n  benchmark: render this many frames and print the costs\n"
+            "  -M  fake monitors, WxH+X+Y[,...]\n"
+            "  -S  pid of the X server, to report its cpu time\n", name, name);
+    exit(1);
+}
+
 int
 main(int argc, char **argv)
 {
+    const char *replay = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:p:Fb:fR:n:M:S:")) != -1) {
+        switch (opt) {
+            case 'r':
+                xdmv_record_open(optarg);
+                break;
+            case 'p':
+                replay = optarg;
+                break;
+            case 'F':
+                xdmv_replay.fast = 1;
+                break;
+            case 'b':
+                xdmv_replay.bars = fopen(optarg, "w");
+                dieifnull(xdmv_replay.bars, "Could not open bars file");
+                break;
+            case 'f':
+                xdmv_feature_export.enabled = 1;
+                break;
+            case 'R':
+                for (xdmv_backend = 0; xdmv_backend < backend_count; xdmv_backend++)
+                    if (!strcmp(optarg, xdmv_backend_names[xdmv_backend]))
+                        break;
+                if (xdmv_backend == backend_count)
+                    usage(argv[0]);
+                break;
+            case 'n':
+                xdmv_bench.frames = strtoul(optarg, NULL, 10);
+                break;
+            case 'M':
+                xdmv_bench_parse_outputs(optarg);
+                break;
+            case 'S':
+                xdmv_bench.server = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    dieif(replay && xdmv_record.fd >= 0, "Can't record while replaying");
+    /* keep the positional arguments where they have always been */
+    const char *name = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    /* a replay has no music file, the display is its only argument */
+    const char *display_name = NULL;
+    int display_arg = replay ? 1 : 2;
+    if (replay && argc > 2)
+        usage(name);
+    if (argc > display_arg)
+        display_name = argv[display_arg];
+
     xdmv_signal_init();
-    xdmv_load_sources(argc,argv);
-    return xdmv_xorg(argc, argv);
+    xdmv_load_sources(argc, argv, replay);
+    return xdmv_xorg(display_name);
 }
 
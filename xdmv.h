@@ -0,0 +1,22 @@
+#ifndef XDMV_H
+#define XDMV_H
+
+typedef struct Spectrum Spectrum;
+
+/* Audio features of a spectrum, updated every frame from the band magnitudes
+ * right after separate_freq_bands and read with xdmv_spectrum_features().
+ * New fields only ever go at the end. */
+struct features {
+    int bars;
+    const float *flux;      /* per band, rectified change of log magnitude */
+    float flux_total;       /* mean over the bands */
+    int onset;              /* 1 on the frame an onset is detected */
+    float onset_strength;   /* how far above the threshold, 0 without onset */
+    float tempo;            /* bpm, 0 until enough history was seen */
+    float loudness;         /* momentary, K-weighted, LUFS-like */
+};
+
+/* valid until the next frame, the flux array is owned by the spectrum */
+const struct features *xdmv_spectrum_features(const Spectrum *s);
+
+#endif